@@ -34,26 +34,44 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #ifndef AUTOBG_H
 #define AUTOBG_H
 
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <iso646.h>
+#include <limits.h>
 #include <op.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 /************************* User Configuration *************************/
 // External dependency which handles background switching for us
 #define ABG_EXEC        "feh"
 // Command line arguments passed to ABG_EXEC
 #define ABG_OPTS        "--bg-scale"
+// External dependency which decodes images into PPM for thumbnailing
+#define ABG_THUMB_EXEC  "convert"
+// Thumbnail cell size in pixels and number of cells per atlas row
+#define ABG_THUMB_W     128
+#define ABG_THUMB_H     80
+#define ABG_THUMB_COLS  16
+// Default minutes between wallpapers when running as a daemon
+#define ABG_INTERVAL    30
 
 /***************************** Constants ******************************/
 #define ABG_DAEMON_NAME     "autobgd"
@@ -61,12 +79,31 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define ABG_VERSION         "0.1.7"
 #define ABG_DATE            "2013-07-26"
 #define ABG_WALLPAPER       "Pictures/Wallpapers"
+#define ABG_CACHE_DIR       ".cache/autobg"
+#define ABG_STATE_DIR       ".local/state/autobg"
+#define ABG_ATLAS_FILE      "thumbs-%016llx.ppm"
+#define ABG_ATLAS_HEADER    64
+#define ABG_INDEX_FILE      "thumbs-%016llx.idx"
+#define ABG_INDEX_MAGIC     "autobg-thumbs-ns"
+#define ABG_THUMB_QUEUE     64
+#define ABG_HASH_SEED       14695981039346656037ULL     // FNV-1a basis
+#define ABG_JOURNAL_FILE    "journal"
+#define ABG_SNAPSHOT_FILE   "state"
+#define ABG_JOURNAL_MAGIC   0xab6c5703
+#define ABG_JOURNAL_BATCH   8       // Records between fdatasync calls
+#define ABG_JOURNAL_MAX     256     // Records before compacting
+
+#define ABG_EV_NEXT         1       // Rotated to a new wallpaper
+#define ABG_EV_SET          2       // Wallpaper set from outside the rotation
+#define ABG_EV_PAUSE        3
+#define ABG_EV_RESUME       4
 
 #define ABG_HELP_BIT        (1 << 0) // 0b00000001
 #define ABG_VERSION_BIT     (1 << 1) // 0b00000010
 #define ABG_DAEMON_BIT      (1 << 2) // 0b00000100
 #define ABG_DIRECTORY_BIT   (1 << 3) // 0b00001000
 #define ABG_INTERVAL_BIT    (1 << 4) // 0b00010000
+#define ABG_THUMBS_BIT      (1 << 5) // 0b00100000
 
 /************************ Function-like Macros ************************/
 #define OVERFLOW(a, b)\
@@ -74,11 +111,56 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
        __typeof__ (b) _b = (b);\
        _a > _b ? 0 : _a })
 
+/******************************* Types ********************************/
+// Everything needed to resume rotation exactly where it left off
+struct abg_state {
+    unsigned long long  seq;
+    int                 paused;
+    long                hint;       // telldir() cookie of current, or -1
+    long long           changed;    // When current was set, ns since epoch
+    char                current[PATH_MAX];
+};
+
+// One wallpaper's place in the thumbnail atlas
+struct thumb_entry {
+    char        *name;
+    long long   mtime;      // In ns; -1 if decoding failed, so it is retried
+    long long   size;
+    int         cell;
+    int         dirty;
+};
+
+struct thumb_index {
+    int                 count;
+    int                 cells;
+    struct thumb_entry  *entries;
+};
+
+struct abg_journal {
+    int                 fd;
+    char                *dir;
+    int                 pending;    // Appended since the last fdatasync
+    int                 records;    // Appended since the last compaction
+    off_t               offset;     // End of the records already applied
+    off_t               last;       // Start of the last applied record
+    struct abg_state    state;
+};
+
+/***************************** Globals ********************************/
+extern int (*bg_backend)(const char *);
+extern unsigned (*bg_sleep)(unsigned);
+extern unsigned long bg_reads;
+
 /************************ Function Prototypes *************************/
 // Setup functions
+char *  get_cache_dir       ();
 char *  get_directory       (const int);
+int     get_interval        (const int);
 char *  get_relpath         (const char*);
+char *  get_state_dir       ();
 void    init_args           ();
+unsigned long long
+        hash_bytes          (unsigned long long, const void *, size_t);
 char *  join_path           (const char *, const char *);
 int     parse_ops           ();
 void    free_bg_strs        (char **);
@@ -87,17 +169,37 @@ void    free_bg_strs        (char **);
 void    close_io            ();
 int     daemonize           ();
 void    open_log            ();
-void    process             ();
+void    process             (const char *, int);
 pid_t   spawn_child         ();
 
 // Program functions
 int     change_bg           (const char *);
 int     count_bgs           (const char *, int *);
 int     count_current_len   (const char *, int *, long *);
+char *  get_current_bg      (struct abg_journal *);
 char *  get_next_bg         (char **, char *);
-int     next_bg             (const char *);
+int     next_bg             (const char *, struct abg_journal *);
 int     parse_current_bg    (const char *, char *, long);
 int     populate_bgs        (const char *, char **);
+char *  stream_next_bg      (const char *, const char *, long *);
+
+// Journal functions
+int     journal_append      (struct abg_journal *, int, const char *, long);
+void    journal_close       (struct abg_journal *);
+int     journal_compact     (struct abg_journal *);
+int     journal_open        (struct abg_journal *, const char *);
+int     journal_refresh     (struct abg_journal *);
+int     journal_sync        (struct abg_journal *);
+
+// Thumbnail functions
+void    blank_stale_cells   (unsigned char *, const struct thumb_index *,
+                             const struct thumb_index *);
+int     decode_image        (const char *, int *, int *, unsigned char **);
+void    free_thumb_index    (struct thumb_index *);
+int     gen_thumbs          (const char *);
+void    scale_thumb         (const unsigned char *, int, int, unsigned char *);
+int     scan_library        (const char *, struct thumb_index *,
+                             struct thumb_index *);
 
 // Print functions
 void    print_help          (const int);
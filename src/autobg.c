@@ -39,14 +39,55 @@ struct program_options {
     //const char * (*sort)(const char **);
 };
 
+// Sets the wallpaper; the stress harness swaps in a stub that records calls
+int (*bg_backend)(const char *) = change_bg;
+// Waits out the interval; the stress harness swaps it to run flat out
+unsigned (*bg_sleep)(unsigned) = sleep;
+// Directory entries stream_next_bg has read, so tests can see the hint work
+unsigned long bg_reads = 0;
+
 /*********************** Command line arguments ***********************/
 const char *D[] = { "-D", "--daemon"    };
 const char *d[] = { "-d", "--directory" };
 const char *h[] = { "-h", "--help"      };
 const char *i[] = { "-i", "--interval"  };
+const char *t[] = { "-t", "--thumbs"    };
 const char *v[] = { "-v", "--version"   };
 
 /************************** Setup Functions ***************************/
+/*
+ * Returns the absolute path of a directory below $HOME, creating it and
+ * any missing parents.
+ */
+static char *make_relpath_dir (const char *relpath)
+{
+    char *path = get_relpath(relpath);
+    size_t home_len = strlen(getenv("HOME"));
+
+    for (char *p = path + home_len + 1; *p; p++) {
+        if (*p not_eq '/')
+            continue;
+        *p = 0;
+        mkdir(path, 0755);
+        *p = '/';
+    }
+    if (mkdir(path, 0755) and errno not_eq EEXIST) {
+        fprintf(stderr, "ERROR: Cannot create %s\n", path);
+        free(path);
+        return NULL;
+    }
+    return path;
+}
+
+/**
+ * Returns the path of the per-user cache directory, creating it if it
+ * doesn't exist yet.
+ */
+char *get_cache_dir ()
+{
+    return make_relpath_dir(ABG_CACHE_DIR);
+}
+
 char *get_directory (const int ops)
 {
     if (not (ops & ABG_DIRECTORY_BIT)) {
@@ -61,7 +102,26 @@ char *get_directory (const int ops)
         print_help(ops);
         exit(EXIT_FAILURE);
     }
-    return args[0];
+    return strdup(args[0]);
+}
+
+/**
+ * Returns the number of minutes to wait between wallpapers in daemon
+ * mode.
+ */
+int get_interval (const int ops)
+{
+    if (not (ops & ABG_INTERVAL_BIT))
+        return ABG_INTERVAL;
+    const char **args = op_arg_cnt(i[0]) ? op_args(i[0]) : NULL;
+    char *end = NULL;
+    long minutes = args ? strtol(args[0], &end, 10) : 0;
+    if (args == NULL or *end or minutes <= 0 or minutes > INT_MAX / 60) {
+        fprintf(stderr, "ERROR: Interval must be a positive number of minutes\n");
+        print_help(ops);
+        exit(EXIT_FAILURE);
+    }
+    return minutes;
 }
 
 char *get_relpath (const char *relpath)
@@ -71,22 +131,44 @@ char *get_relpath (const char *relpath)
     return path;
 }
 
+/**
+ * Returns the path of the per-user directory holding the rotation
+ * journal, creating it if it doesn't exist yet.
+ */
+char *get_state_dir ()
+{
+    return make_relpath_dir(ABG_STATE_DIR);
+}
+
 void init_args ()
 {
-    op_init(5);
+    op_init(6);
 
     op_add_option(d, 2);
     op_add_option(D, 2);
     op_add_option(h, 2);
     op_add_option(i, 2);
+    op_add_option(t, 2);
     op_add_option(v, 2);
 }
 
+/**
+ * Folds len bytes into an FNV-1a hash. Start from ABG_HASH_SEED, and feed
+ * the result back in to hash several buffers as one.
+ */
+unsigned long long hash_bytes (unsigned long long hash, const void *buf,
+        size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ ((const unsigned char *) buf)[i]) * 1099511628211ULL;
+    return hash;
+}
+
 char *join_path (const char *root, const char *rel)
 {
     int root_len = strlen(root);
     int rel_len  = strlen(rel);
-    char *full   = malloc(root_len + rel_len + 1);
+    char *full   = malloc(root_len + rel_len + 2);
 
     strcpy(full, root);
     strcat(full, "/");
@@ -110,6 +192,8 @@ int parse_ops (int argc, const char **argv)
         flags = flags | ABG_DIRECTORY_BIT;
     if (op_is_set(i[0]))
         flags = flags | ABG_INTERVAL_BIT;
+    if (op_is_set(t[0]))
+        flags = flags | ABG_THUMBS_BIT;
 
     return flags;
 }
@@ -169,9 +253,68 @@ void open_log ()
     syslog(LOG_INFO, "Starting Daemon");
 }
 
-void process (const char *dir)
+static volatile sig_atomic_t stop_requested   = 0;
+static volatile sig_atomic_t pause_requested  = 0;
+
+static void handle_signal (int sig)
 {
+    if (sig == SIGUSR1)
+        pause_requested = 1;
+    else
+        stop_requested = 1;
+}
 
+/**
+ * The daemon's main loop. Switches wallpaper every interval minutes until
+ * SIGTERM or SIGINT, and SIGUSR1 toggles pausing the rotation.
+ *
+ * Rotation state comes from the journal, so a restarted daemon puts back
+ * the wallpaper it was showing and carries on from there, or from the one
+ * set by hand with feh while it was stopped.
+ */
+void process (const char *dir, int interval)
+{
+    char *state_dir = get_state_dir();
+    struct abg_journal j;
+    if (state_dir == NULL or journal_open(&j, state_dir)) {
+        syslog(LOG_ERR, "Cannot open rotation journal");
+        free(state_dir);
+        return;
+    }
+    free(state_dir);
+
+    stop_requested = pause_requested = 0;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // Put back what was showing, unless feh was run by hand meanwhile
+    unsigned left = 0;
+    char *current = get_current_bg(&j);
+    if (current[0] and not bg_backend(current))
+        left = interval * 60;
+    free(current);
+
+    while (not stop_requested) {
+        if (pause_requested) {
+            pause_requested = 0;
+            journal_append(&j, j.state.paused ? ABG_EV_RESUME : ABG_EV_PAUSE,
+                    j.state.current, j.state.hint);
+        }
+        if (left == 0) {
+            if (not j.state.paused)
+                next_bg(dir, &j);
+            left = interval * 60;
+        }
+        left = bg_sleep(left);
+    }
+
+    syslog(LOG_INFO, "Stopping Daemon");
+    journal_close(&j);
 }
 
 /**
@@ -271,6 +414,53 @@ int count_current_len (const char *path, int *count, long *offset)
     return EXIT_SUCCESS;
 }
 
+/*
+ * Whether ~/.fehbg was written after the journal last recorded a new
+ * wallpaper, i.e. someone ran feh by hand since. Pauses and other
+ * records don't count, so they can't hide a manual set.
+ */
+static int fehbg_newer (const char *fehpath, const struct abg_journal *j)
+{
+    struct stat feh;
+    if (stat(fehpath, &feh))
+        return 0;
+    return feh.st_mtim.tv_sec * 1000000000LL + feh.st_mtim.tv_nsec
+        > j->state.changed;
+}
+
+/**
+ * Returns a malloc'd copy of the wallpaper currently shown, or an empty
+ * string if it isn't known. The journal, brought up to date with other
+ * processes first, is trusted unless ~/.fehbg is newer and names a
+ * different file, in which case that manual set is journaled.
+ */
+char *get_current_bg (struct abg_journal *j)
+{
+    if (j not_eq NULL)
+        journal_refresh(j);
+
+    char *fehpath = get_relpath(".fehbg");
+    char *current = NULL;
+    if (j == NULL or fehbg_newer(fehpath, j)) {
+        int count = 0;
+        long offset = 0;
+        if (not count_current_len(fehpath, &count, &offset)) {
+            current = calloc(count + 1, 1);
+            if (parse_current_bg(fehpath, current, offset))
+                current[0] = 0;
+        }
+    }
+    free(fehpath);
+
+    if (j == NULL)
+        return current ? current : calloc(1, 1);
+    if (current not_eq NULL and current[0]
+            and strcmp(current, j->state.current))
+        journal_append(j, ABG_EV_SET, current, -1);
+    free(current);
+    return strdup(j->state.current);
+}
+
 /*
  * 
  */
@@ -294,48 +484,25 @@ char *get_next_bg (char **bg_list, char *current)
 
 /**
  * Opens the directory specified, gets the next wallpaper, and changes
- * the wallpaper.
+ * the wallpaper. The position comes from the journal when there is one,
+ * falling back to whatever feh last wrote to ~/.fehbg.
  */
-int next_bg (const char *path)
+int next_bg (const char *path, struct abg_journal *j)
 {
-    char *fehpath = get_relpath(".fehbg");
- 
-    int count = 0;
-    if (count_bgs(path, &count))
-        return EXIT_FAILURE;
-
-    char **bg_list = malloc((count + 1) * sizeof(char*));
-    bg_list[count] = NULL;
-    if (populate_bgs(path, bg_list)) {
-        printf("Populating failed");
-        free(fehpath);
-        free_bg_strs(bg_list);
-        return EXIT_FAILURE;
-    }
+    char *current = get_current_bg(j);
 
-    count = 0;
-    long offset = 0;
-    if (count_current_len(fehpath, &count, &offset)) {
-        printf("Counting failed");
+    long hint = j not_eq NULL ? j->state.hint : -1;
+    char *bg = stream_next_bg(path, current, &hint);
+    free(current);
+    if (bg == NULL)
         return EXIT_FAILURE;
-    }
 
-    char *current = malloc(count);
-    if (parse_current_bg(fehpath, current, offset)) {
-        printf("Parsing failed");
-        free(fehpath);
-        free_bg_strs(bg_list);
-        free(current);
-        return EXIT_SUCCESS;
-    }
+    int status = bg_backend(bg);
+    if (j not_eq NULL and status == 0)
+        journal_append(j, ABG_EV_NEXT, bg, hint);
+    free(bg);
 
-    char *bg = get_next_bg(bg_list, current);
-    free(fehpath);
-    free(current);
-    change_bg(bg);
-    free_bg_strs(bg_list);
-
-    return EXIT_SUCCESS;
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 /*
@@ -354,7 +521,8 @@ int parse_current_bg (const char *path, char *current, long offset)
     fclose(feh);
 
     size_t len = strlen(current);
-    current[len - 1] = 0; // trim off an excess ' that feh puts in
+    if (len)
+        current[len - 1] = 0; // trim off an excess ' that feh puts in
 
     return EXIT_SUCCESS;
 }
@@ -385,17 +553,112 @@ int populate_bgs (const char *path, char **bg_list)
     return EXIT_SUCCESS;
 }
 
+/*
+ * Reads the next entry other than . and .., storing the telldir() cookie
+ * that seeks back to it in pos.
+ */
+static struct dirent *read_bg (DIR *dir, long *pos)
+{
+    struct dirent *ent;
+    for (;;) {
+        *pos = telldir(dir);
+        if ((ent = readdir(dir)) == NULL)
+            return NULL;
+        ++bg_reads;
+        char *f = ent->d_name;
+        if (not (f[0] == '.' && (f[1] == 0 or f[1] == '.')))
+            return ent;
+    }
+}
+
+/*
+ * Like read_bg, but skips anything that isn't a regular file, such as
+ * subdirectories or entries deleted since they were listed.
+ */
+static struct dirent *read_file (DIR *dir, long *pos)
+{
+    struct dirent *ent;
+    struct stat st;
+    while ((ent = read_bg(dir, pos)) not_eq NULL) {
+        if (not fstatat(dirfd(dir), ent->d_name, &st, 0)
+                and S_ISREG(st.st_mode))
+            return ent;
+    }
+    return NULL;
+}
+
+/**
+ * Finds the wallpaper after current without listing the whole directory.
+ *
+ * hint is the directory position current was found at last time. If the
+ * entry there is still current, reading carries on from it. Otherwise the
+ * directory is scanned from the start, stopping as soon as the successor
+ * is known. The first file is only used on wraparound or if current isn't
+ * in the directory; when current isn't even under path, no scan is done.
+ * Only regular files are returned, so subdirectories are never chosen.
+ *
+ * @return The malloc'd absolute path of the next wallpaper with its
+ *              position in hint, or NULL if there are no wallpapers.
+ */
+char *stream_next_bg (const char *path, const char *current, long *hint)
+{
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "ERROR: Cannot open wallpaper directory.\n");
+        return NULL;
+    }
+
+    size_t path_len = strlen(path);
+    const char *name = NULL;
+    if (not strncmp(current, path, path_len) and current[path_len] == '/')
+        name = current + path_len + 1;
+
+    struct dirent *ent = NULL;
+    long pos = -1;
+    int found = 0;
+    if (name not_eq NULL and *hint >= 0) {
+        seekdir(dir, *hint);
+        ent = readdir(dir);
+        bg_reads += ent not_eq NULL;
+        found = ent not_eq NULL and not strcmp(ent->d_name, name);
+    }
+    if (name not_eq NULL and not found) {
+        rewinddir(dir);
+        while (not found and (ent = read_bg(dir, &pos)) not_eq NULL)
+            found = not strcmp(ent->d_name, name);
+    }
+    ent = found ? read_file(dir, &pos) : NULL;
+    // Wrapped around, or current is gone or unknown: use the first file
+    if (ent == NULL) {
+        rewinddir(dir);
+        ent = read_file(dir, &pos);
+    }
+
+    char *next = NULL;
+    if (ent not_eq NULL) {
+        next = join_path(path, ent->d_name);
+        *hint = pos;
+    } else {
+        fprintf(stderr, "ERROR: No wallpapers in %s\n", path);
+    }
+    closedir(dir);
+    return next;
+}
+
 /************************** Print Functions ***************************/
 void print_help (const int flags)
 {
     print_version();
-    printf("Usage:\n%s [-Dhv] [-d <directory>] [-i <interval>]",
+    printf("Usage:\n%s [-Dhtv] [-d <directory>] [-i <interval>]",
             ABG_PROGRAM_NAME);
     printf("\n\nOPTIONS\n");
     print_opt("-h", "--help", "Print this message");
     print_opt("-v", "--version", "Print the current version");
-    print_opt("-D", "--daemon", "Run as a daemon");
+    print_opt("-D", "--daemon",
+            "Run as a daemon. Send it SIGUSR1 to pause or resume rotation");
     print_opt("-d", "--directory", "Specify the directory to search in");
+    print_opt("-t", "--thumbs",
+            "Generate a thumbnail atlas of the directory in ~/" ABG_CACHE_DIR);
     print_opt("-i", "--interval",
             "Value in minutes to wait between each wallpaper. Only works\
                 \twith the -D option");
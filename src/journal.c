@@ -0,0 +1,401 @@
+/*
+Copyright (c) 2013 Ryan Porterfield
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+    * Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.
+
+   	* Redistributions in binary form must reproduce the above
+copyright notice, this list of conditions and the following disclaimer
+in the documentation and/or other materials provided with the
+distribution.
+
+	* Neither the name of the copyright owners nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <autobg.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * On-disk layout of one journal entry. It is followed by len bytes of
+ * path, and crc covers everything after the crc field including the
+ * path, so a torn or partially written tail is detected on replay.
+ */
+struct journal_record {
+    unsigned            crc;
+    unsigned short      type;
+    unsigned short      len;
+    unsigned long long  seq;
+    long long           time;       // ns since the epoch
+    long long           hint;
+};
+
+/*
+ * On-disk layout of the compacted state, followed by len bytes of path.
+ */
+struct journal_snapshot {
+    unsigned            magic;
+    unsigned            crc;
+    unsigned long long  seq;
+    long long           hint;
+    long long           changed;
+    int                 paused;
+    unsigned            len;
+};
+
+/************************** Helper Functions **************************/
+static unsigned crc32 (unsigned crc, const unsigned char *buf, size_t len)
+{
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static int write_all (int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 and errno == EINTR)
+            continue;
+        if (n <= 0)
+            return EXIT_FAILURE;
+        p   += n;
+        len -= n;
+    }
+    return EXIT_SUCCESS;
+}
+
+static void apply_record (struct abg_state *state,
+        const struct journal_record *rec, const char *path)
+{
+    switch (rec->type) {
+    case ABG_EV_NEXT:
+    case ABG_EV_SET:
+        memcpy(state->current, path, rec->len);
+        state->current[rec->len] = 0;
+        state->hint    = rec->hint;
+        state->changed = rec->time;
+        break;
+    case ABG_EV_PAUSE:
+        state->paused = 1;
+        break;
+    case ABG_EV_RESUME:
+        state->paused = 0;
+        break;
+    }
+    state->seq = rec->seq;
+}
+
+/*
+ * Loads the last compacted state. A missing or damaged snapshot leaves
+ * the state empty.
+ */
+static void load_snapshot (const char *dir, struct abg_state *state)
+{
+    memset(state, 0, sizeof(struct abg_state));
+    state->hint = -1;
+
+    char *path = join_path(dir, ABG_SNAPSHOT_FILE);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    free(path);
+    if (fd < 0)
+        return;
+
+    struct journal_snapshot snap;
+    char current[PATH_MAX];
+    if (read(fd, &snap, sizeof(snap)) == sizeof(snap)
+            and snap.magic == ABG_JOURNAL_MAGIC and snap.len < PATH_MAX
+            and read(fd, current, snap.len) == snap.len) {
+        unsigned crc = crc32(0, (unsigned char *) &snap.seq,
+                sizeof(snap) - offsetof(struct journal_snapshot, seq));
+        if (crc32(crc, (unsigned char *) current, snap.len) == snap.crc) {
+            memcpy(state->current, current, snap.len);
+            state->current[snap.len] = 0;
+            state->seq     = snap.seq;
+            state->paused  = snap.paused;
+            state->hint    = snap.hint;
+            state->changed = snap.changed;
+        }
+    }
+    close(fd);
+}
+
+/*
+ * Replays every intact record newer than the snapshot, then cuts the file
+ * back to the end of the last one so new appends don't follow garbage.
+ * A gap in sequence numbers is not a torn tail: if the snapshot was lost
+ * or damaged, the records after it still hold the newest state, so replay
+ * carries on from the first one it can read.
+ * Must hold the journal lock, or the tail cut could be another process's
+ * record in flight.
+ */
+static int replay_journal (struct abg_journal *j)
+{
+    struct stat st;
+    if (fstat(j->fd, &st))
+        return EXIT_FAILURE;
+
+    size_t size = st.st_size, off = 0;
+    unsigned char *buf = malloc(size + 1);
+    if (buf == NULL or pread(j->fd, buf, size, 0) not_eq (ssize_t) size) {
+        free(buf);
+        return EXIT_FAILURE;
+    }
+
+    j->records = 0;
+    j->last    = 0;
+    while (off + sizeof(struct journal_record) <= size) {
+        struct journal_record rec;
+        memcpy(&rec, buf + off, sizeof(rec));
+        size_t end = off + sizeof(rec) + rec.len;
+        if (rec.len >= PATH_MAX or end > size
+                or crc32(0, buf + off + sizeof(rec.crc),
+                    end - off - sizeof(rec.crc)) not_eq rec.crc)
+            break;
+        if (rec.seq > j->state.seq)
+            apply_record(&j->state, &rec, (char *) buf + off + sizeof(rec));
+        ++j->records;
+        j->last = off;
+        off = end;
+    }
+    free(buf);
+
+    j->offset = off;
+    if (off < size and ftruncate(j->fd, off))
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+static int load_state (struct abg_journal *j)
+{
+    load_snapshot(j->dir, &j->state);
+    return replay_journal(j);
+}
+
+/*
+ * Checks whether another process has appended or compacted since this
+ * handle last looked. Must hold the journal lock. Sequence numbers only
+ * grow, so the record (or snapshot) at the end we know about carries a
+ * different seq if the file was compacted and refilled to the same size.
+ */
+static int journal_stale (struct abg_journal *j)
+{
+    struct stat st;
+    if (fstat(j->fd, &st) or st.st_size not_eq j->offset)
+        return 1;
+
+    if (j->offset == 0) {
+        struct abg_state snap;
+        load_snapshot(j->dir, &snap);
+        return snap.seq not_eq j->state.seq;
+    }
+    struct journal_record rec;
+    return pread(j->fd, &rec, sizeof(rec), j->last) not_eq sizeof(rec)
+        or rec.seq not_eq j->state.seq;
+}
+
+/*
+ * Writes the current state as the snapshot and empties the journal. Must
+ * hold the journal lock.
+ */
+static int compact_journal (struct abg_journal *j)
+{
+    struct journal_snapshot snap;
+    size_t len = strlen(j->state.current);
+    snap.magic   = ABG_JOURNAL_MAGIC;
+    snap.seq     = j->state.seq;
+    snap.hint    = j->state.hint;
+    snap.changed = j->state.changed;
+    snap.paused  = j->state.paused;
+    snap.len     = len;
+    snap.crc     = crc32(crc32(0, (unsigned char *) &snap.seq,
+                sizeof(snap) - offsetof(struct journal_snapshot, seq)),
+            (unsigned char *) j->state.current, len);
+
+    char *path = join_path(j->dir, ABG_SNAPSHOT_FILE);
+    char *tmp  = join_path(j->dir, ABG_SNAPSHOT_FILE ".tmp");
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int status = fd < 0
+        or write_all(fd, &snap, sizeof(snap))
+        or write_all(fd, j->state.current, len)
+        or fsync(fd);
+    if (fd >= 0)
+        close(fd);
+    status = status or rename(tmp, path);
+    free(path);
+    free(tmp);
+    if (status)
+        return EXIT_FAILURE;
+
+    int dir = open(j->dir, O_RDONLY | O_CLOEXEC);
+    if (dir >= 0) {
+        fsync(dir);
+        close(dir);
+    }
+
+    if (ftruncate(j->fd, 0))
+        return EXIT_FAILURE;
+    j->records = 0;
+    j->pending = 0;
+    j->offset  = 0;
+    j->last    = 0;
+    return EXIT_SUCCESS;
+}
+
+/************************** Journal Functions *************************/
+/**
+ * Appends one event to the journal and applies it to the in-memory
+ * state. For rotations, hint is the directory position of the new
+ * wallpaper so the next switch can seek straight to it. This costs a
+ * single write; the data is only fdatasync'd every ABG_JOURNAL_BATCH
+ * records, or straight away for anything other than a plain rotation.
+ */
+int journal_append (struct abg_journal *j, int type, const char *path,
+        long hint)
+{
+    size_t len = strlen(path);
+    if (len >= PATH_MAX)
+        return EXIT_FAILURE;
+
+    // Another autobg may share the journal; catch up with it first
+    if (flock(j->fd, LOCK_EX))
+        return EXIT_FAILURE;
+    if (journal_stale(j) and load_state(j)) {
+        flock(j->fd, LOCK_UN);
+        return EXIT_FAILURE;
+    }
+
+    unsigned char buf[sizeof(struct journal_record) + PATH_MAX];
+    struct journal_record rec;
+    rec.type = type;
+    rec.len  = len;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    rec.seq  = j->state.seq + 1;
+    rec.time = now.tv_sec * 1000000000LL + now.tv_nsec;
+    rec.hint = hint;
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), path, len);
+    rec.crc = crc32(0, buf + sizeof(rec.crc),
+            sizeof(rec) - sizeof(rec.crc) + len);
+    memcpy(buf, &rec.crc, sizeof(rec.crc));
+
+    if (write_all(j->fd, buf, sizeof(rec) + len)) {
+        ftruncate(j->fd, j->offset);    // Don't leave half a record behind
+        flock(j->fd, LOCK_UN);
+        return EXIT_FAILURE;
+    }
+    apply_record(&j->state, &rec, path);
+    j->last    = j->offset;
+    j->offset += sizeof(rec) + len;
+    ++j->records;
+    ++j->pending;
+
+    int status = EXIT_SUCCESS;
+    if (j->pending >= ABG_JOURNAL_BATCH or type not_eq ABG_EV_NEXT)
+        status = journal_sync(j);
+    if (not status and j->records >= ABG_JOURNAL_MAX)
+        status = compact_journal(j);
+    flock(j->fd, LOCK_UN);
+    return status;
+}
+
+void journal_close (struct abg_journal *j)
+{
+    journal_sync(j);
+    close(j->fd);
+    free(j->dir);
+    j->fd  = -1;
+    j->dir = NULL;
+}
+
+/**
+ * Folds the journal into a fresh snapshot and empties it. The snapshot is
+ * durable before the journal is truncated, and replay skips records the
+ * snapshot already covers, so a crash at any point loses nothing.
+ */
+int journal_compact (struct abg_journal *j)
+{
+    if (flock(j->fd, LOCK_EX))
+        return EXIT_FAILURE;
+    int status = (journal_stale(j) and load_state(j)) or compact_journal(j);
+    flock(j->fd, LOCK_UN);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Opens the journal in dir and recovers the rotation state from the last
+ * snapshot plus the records appended after it. Compaction keeps the
+ * journal short, so this takes constant time however long autobg has
+ * been running.
+ */
+int journal_open (struct abg_journal *j, const char *dir)
+{
+    char *path = join_path(dir, ABG_JOURNAL_FILE);
+    j->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    free(path);
+    if (j->fd < 0)
+        return EXIT_FAILURE;
+
+    j->dir     = strdup(dir);
+    j->pending = 0;
+    if (flock(j->fd, LOCK_EX)) {
+        journal_close(j);
+        return EXIT_FAILURE;
+    }
+    int status = load_state(j)
+        or (j->records >= ABG_JOURNAL_MAX and compact_journal(j));
+    flock(j->fd, LOCK_UN);
+    if (status) {
+        journal_close(j);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Catches up with records other processes appended, or a compaction they
+ * did, since this handle last looked. Call it before trusting the state.
+ */
+int journal_refresh (struct abg_journal *j)
+{
+    if (flock(j->fd, LOCK_EX))
+        return EXIT_FAILURE;
+    int status = journal_stale(j) and load_state(j);
+    flock(j->fd, LOCK_UN);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int journal_sync (struct abg_journal *j)
+{
+    if (j->pending == 0)
+        return EXIT_SUCCESS;
+    j->pending = 0;
+    return fdatasync(j->fd) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+// EOF
@@ -48,19 +48,34 @@ int main (int argc, const char **argv)
 
     char *path = get_directory(ops);
 
+    if (ops & ABG_THUMBS_BIT) {
+        int status = gen_thumbs(path);
+        free(path);
+        return status;
+    }
+
     if (not (ops & ABG_DAEMON_BIT)) {
-        next_bg(path);
+        char *state_dir = get_state_dir();
+        struct abg_journal j;
+        int journaled = state_dir not_eq NULL
+            and not journal_open(&j, state_dir);
+        next_bg(path, journaled ? &j : NULL);
+        if (journaled)
+            journal_close(&j);
+        free(state_dir);
         free(path);
         return EXIT_SUCCESS;
     }
 
+    const int interval = get_interval(ops);
+
     int d = daemonize();
     if (d < 0)
         return EXIT_FAILURE;
     if (d > 0)
         return EXIT_SUCCESS;
 
-    process();
+    process(path, interval);
 
     return EXIT_SUCCESS;
 }
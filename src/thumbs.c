@@ -0,0 +1,638 @@
+/*
+Copyright (c) 2013 Ryan Porterfield
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+    * Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.
+
+   	* Redistributions in binary form must reproduce the above
+copyright notice, this list of conditions and the following disclaimer
+in the documentation and/or other materials provided with the
+distribution.
+
+	* Neither the name of the copyright owners nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE                     // pipe2()
+#include <autobg.h>
+
+struct thumb_job {
+    struct thumb_entry  *entry;
+    char                *path;
+    unsigned char       *pixels;
+};
+
+/*
+ * Fixed-size ring of jobs shared between two pipeline stages. Producers
+ * block while it is full so memory use doesn't depend on library size.
+ */
+struct thumb_queue {
+    struct thumb_job    *items[ABG_THUMB_QUEUE];
+    int                 head;
+    int                 count;
+    pthread_mutex_t     lock;
+    pthread_cond_t      not_empty;
+    pthread_cond_t      not_full;
+};
+
+struct thumb_pipeline {
+    struct thumb_queue  decode;
+    struct thumb_queue  pack;
+    unsigned char       *atlas;
+};
+
+/*************************** Queue Functions **************************/
+static void queue_init (struct thumb_queue *q)
+{
+    q->head  = 0;
+    q->count = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+static void queue_destroy (struct thumb_queue *q)
+{
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+/*
+ * A NULL job is the end-of-stream marker for whoever pops it.
+ */
+static void queue_push (struct thumb_queue *q, struct thumb_job *job)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == ABG_THUMB_QUEUE)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % ABG_THUMB_QUEUE] = job;
+    ++q->count;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct thumb_job *queue_pop (struct thumb_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    struct thumb_job *job = q->items[q->head];
+    q->head = (q->head + 1) % ABG_THUMB_QUEUE;
+    --q->count;
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/*************************** Image Functions **************************/
+static int read_ppm_int (FILE *in, int *value)
+{
+    int c = fgetc(in);
+    while (c == '#' or c == ' ' or c == '\t' or c == '\n' or c == '\r') {
+        if (c == '#')
+            while ((c = fgetc(in)) not_eq EOF and c not_eq '\n');
+        c = fgetc(in);
+    }
+    if (c < '0' or c > '9')
+        return EXIT_FAILURE;
+    int v = 0;
+    for (; c >= '0' and c <= '9'; c = fgetc(in))
+        v = v * 10 + (c - '0');
+    *value = v;
+    return EXIT_SUCCESS;    // Consumes the single whitespace after the value
+}
+
+/**
+ * Decodes an image by piping it through ABG_THUMB_EXEC as an 8-bit PPM.
+ *
+ * The external decoder is asked for a copy no larger than twice the
+ * cell size so huge wallpapers don't go over the pipe at full size.
+ *
+ * @return EXIT_SUCCESS and a malloc'd RGB buffer in pixels, or
+ *              EXIT_FAILURE if the file couldn't be decoded.
+ */
+int decode_image (const char *path, int *w, int *h, unsigned char **pixels)
+{
+    char size[32];
+    snprintf(size, sizeof(size), "%dx%d>", ABG_THUMB_W * 2, ABG_THUMB_H * 2);
+
+    // Close-on-exec so sibling decoders never hold each other's pipes open
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC))
+        return EXIT_FAILURE;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execlp(ABG_THUMB_EXEC, ABG_THUMB_EXEC, path, "-auto-orient",
+                "-thumbnail", size, "-depth", "8", "ppm:-", (char *) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    FILE *in = fdopen(fds[0], "r");
+    int status = EXIT_FAILURE, maxval = 0;
+    *pixels = NULL;
+    if (in not_eq NULL and fgetc(in) == 'P' and fgetc(in) == '6'
+            and not read_ppm_int(in, w) and not read_ppm_int(in, h)
+            and not read_ppm_int(in, &maxval) and maxval == 255
+            and *w > 0 and *h > 0) {
+        size_t len = (size_t) *w * *h * 3;
+        *pixels = malloc(len);
+        if (*pixels not_eq NULL and fread(*pixels, 1, len, in) == len)
+            status = EXIT_SUCCESS;
+    }
+
+    if (in not_eq NULL)
+        fclose(in);
+    else
+        close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    if (status) {
+        free(*pixels);
+        *pixels = NULL;
+    }
+    return status;
+}
+
+/**
+ * Box-filters an RGB image down to fit an ABG_THUMB_W x ABG_THUMB_H cell,
+ * keeping its aspect ratio and centering it on a black background.
+ */
+void scale_thumb (const unsigned char *src, int w, int h, unsigned char *cell)
+{
+    int dw = ABG_THUMB_W, dh = (int) ((long) h * ABG_THUMB_W / w);
+    if (dh > ABG_THUMB_H) {
+        dh = ABG_THUMB_H;
+        dw = (int) ((long) w * ABG_THUMB_H / h);
+    }
+    if (dw > w or dh > h) {             // Never upscale
+        dw = w;
+        dh = h;
+    }
+    dw = dw ? dw : 1;
+    dh = dh ? dh : 1;
+
+    int ox = (ABG_THUMB_W - dw) / 2, oy = (ABG_THUMB_H - dh) / 2;
+    memset(cell, 0, ABG_THUMB_W * ABG_THUMB_H * 3);
+
+    for (int y = 0; y < dh; y++) {
+        int y0 = (int) ((long) y * h / dh), y1 = (int) ((long) (y + 1) * h / dh);
+        for (int x = 0; x < dw; x++) {
+            int x0 = (int) ((long) x * w / dw);
+            int x1 = (int) ((long) (x + 1) * w / dw);
+            unsigned long sum[3] = { 0, 0, 0 }, n = 0;
+            for (int sy = y0; sy < y1; sy++) {
+                const unsigned char *p = src + ((size_t) sy * w + x0) * 3;
+                for (int sx = x0; sx < x1; sx++, p += 3, n++) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                }
+            }
+            unsigned char *d = cell
+                + ((size_t) (oy + y) * ABG_THUMB_W + ox + x) * 3;
+            for (int c = 0; c < 3; c++)
+                d[c] = n ? sum[c] / n : 0;
+        }
+    }
+}
+
+/*************************** Atlas Functions **************************/
+static unsigned char *cell_origin (unsigned char *atlas, int cell)
+{
+    size_t stride = (size_t) ABG_THUMB_COLS * ABG_THUMB_W * 3;
+    size_t row    = cell / ABG_THUMB_COLS;
+    size_t col    = cell % ABG_THUMB_COLS;
+    return atlas + row * ABG_THUMB_H * stride + col * ABG_THUMB_W * 3;
+}
+
+static void copy_cell (unsigned char *atlas, int cell, const unsigned char *px)
+{
+    size_t stride = (size_t) ABG_THUMB_COLS * ABG_THUMB_W * 3;
+    unsigned char *dst = cell_origin(atlas, cell);
+    for (int y = 0; y < ABG_THUMB_H; y++)
+        memcpy(dst + y * stride, px + y * ABG_THUMB_W * 3, ABG_THUMB_W * 3);
+}
+
+static int atlas_height (int cells)
+{
+    int rows = (cells + ABG_THUMB_COLS - 1) / ABG_THUMB_COLS;
+    return (rows ? rows : 1) * ABG_THUMB_H;
+}
+
+static size_t atlas_size (int cells)
+{
+    return ABG_ATLAS_HEADER
+        + (size_t) ABG_THUMB_COLS * ABG_THUMB_W * atlas_height(cells) * 3;
+}
+
+/**
+ * Blanks the cells of files that were in the old index but are gone now,
+ * so the sheet doesn't show stale art.
+ */
+void blank_stale_cells (unsigned char *atlas, const struct thumb_index *old,
+        const struct thumb_index *idx)
+{
+    char *live = calloc(idx->cells + 1, 1);
+    for (int i = 0; i < idx->count; i++)
+        live[idx->entries[i].cell] = 1;
+    unsigned char *blank = calloc(ABG_THUMB_W * ABG_THUMB_H * 3, 1);
+    for (int c = 0; c < old->cells and c < idx->cells; c++)
+        if (not live[c])
+            copy_cell(atlas, c, blank);
+    free(blank);
+    free(live);
+}
+
+/**
+ * Maps the atlas file, growing it to hold the given number of cells.
+ *
+ * The atlas is a binary PPM whose header is padded to ABG_ATLAS_HEADER
+ * bytes, so cell offsets never move as rows are appended and the file
+ * can be opened directly in any image viewer as a contact sheet.
+ */
+static unsigned char *map_atlas (int fd, int cells, size_t *len)
+{
+    int width  = ABG_THUMB_COLS * ABG_THUMB_W;
+    int height = atlas_height(cells);
+    *len = atlas_size(cells);
+
+    if (ftruncate(fd, *len))
+        return NULL;
+    unsigned char *map = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    char dims[32];
+    int dims_len = snprintf(dims, sizeof(dims), "\n%d %d\n255\n", width,
+            height);
+    memset(map, ' ', ABG_ATLAS_HEADER);
+    memcpy(map, "P6\n#", 4);
+    memcpy(map + ABG_ATLAS_HEADER - dims_len, dims, dims_len);
+    return map;
+}
+
+/*************************** Index Functions **************************/
+static int compare_entries (const void *a, const void *b)
+{
+    return strcmp(((const struct thumb_entry *) a)->name,
+            ((const struct thumb_entry *) b)->name);
+}
+
+void free_thumb_index (struct thumb_index *idx)
+{
+    for (int i = 0; i < idx->count; i++)
+        free(idx->entries[i].name);
+    free(idx->entries);
+    idx->entries = NULL;
+    idx->count   = 0;
+    idx->cells   = 0;
+}
+
+static void strip_newline (char *s)
+{
+    size_t len = strlen(s);
+    if (len and s[len - 1] == '\n')
+        s[len - 1] = 0;
+}
+
+/**
+ * Reads the index left by a previous run. A missing index, or one built
+ * for another directory or cell geometry, loads as empty so every file
+ * gets regenerated.
+ */
+static void load_index (const char *path, const char *dir,
+        struct thumb_index *idx)
+{
+    idx->count   = 0;
+    idx->cells   = 0;
+    idx->entries = NULL;
+
+    FILE *in = fopen(path, "r");
+    if (in == NULL)
+        return;
+
+    // The header holds the directory, so lines can be up to PATH_MAX long
+    char *line = NULL, magic[32];
+    size_t line_len = 0;
+    int w, h, cols, count, n = 0;
+    if (getline(&line, &line_len, in) < 0
+            or sscanf(line, "%31s %d %d %d %d %n", magic, &w, &h, &cols,
+                &count, &n) not_eq 5 or n == 0) {
+        free(line);
+        fclose(in);
+        return;
+    }
+    strip_newline(line);
+    if (strcmp(magic, ABG_INDEX_MAGIC) or w not_eq ABG_THUMB_W
+            or h not_eq ABG_THUMB_H or cols not_eq ABG_THUMB_COLS
+            or count < 0 or strcmp(line + n, dir)) {
+        free(line);
+        fclose(in);
+        return;
+    }
+
+    idx->entries = malloc((count + 1) * sizeof(struct thumb_entry));
+    while (idx->count < count and getline(&line, &line_len, in) >= 0) {
+        struct thumb_entry *e = &idx->entries[idx->count];
+        strip_newline(line);
+        if (sscanf(line, "%d %lld %lld %n", &e->cell, &e->mtime, &e->size,
+                    &n) not_eq 3 or e->cell < 0)
+            break;
+        e->name  = strdup(line + n);
+        e->dirty = 0;
+        if (e->cell >= idx->cells)
+            idx->cells = e->cell + 1;
+        ++idx->count;
+    }
+    free(line);
+    fclose(in);
+    qsort(idx->entries, idx->count, sizeof(struct thumb_entry),
+            compare_entries);
+}
+
+static int save_index (const char *path, const char *dir,
+        const struct thumb_index *idx)
+{
+    char *tmp = malloc(strlen(path) + 5);
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        free(tmp);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "%s %d %d %d %d %s\n", ABG_INDEX_MAGIC, ABG_THUMB_W,
+            ABG_THUMB_H, ABG_THUMB_COLS, idx->count, dir);
+    for (int i = 0; i < idx->count; i++) {
+        const struct thumb_entry *e = &idx->entries[i];
+        fprintf(out, "%d %lld %lld %s\n", e->cell, e->mtime, e->size, e->name);
+    }
+    int status = fclose(out) or rename(tmp, path);
+    free(tmp);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Lists the regular files in dir and gives each one an atlas cell. Files
+ * unchanged since the old index keep their cell untouched, changed ones
+ * are marked dirty in place, and new ones reuse cells freed by deleted
+ * files before the atlas is grown.
+ */
+int scan_library (const char *dir, struct thumb_index *old,
+        struct thumb_index *idx)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        fprintf(stderr, "ERROR: Cannot open wallpaper directory.\n");
+        return EXIT_FAILURE;
+    }
+
+    int cap = 64;
+    idx->count   = 0;
+    idx->cells   = old->cells;
+    idx->entries = malloc(cap * sizeof(struct thumb_entry));
+
+    char *used = calloc(old->cells + 1, 1);
+    struct dirent *ent;
+    while ((ent = readdir(d)) not_eq NULL) {
+        char *f = ent->d_name;
+        if (f[0] == '.' && (f[1] == 0 or f[1] == '.'))
+            continue;
+        if (strchr(f, '\n'))
+            continue;
+        char *abs = join_path(dir, f);
+        struct stat st;
+        int ok = not stat(abs, &st) and S_ISREG(st.st_mode);
+        free(abs);
+        if (not ok)
+            continue;
+
+        if (idx->count == cap) {
+            cap *= 2;
+            idx->entries = realloc(idx->entries,
+                    cap * sizeof(struct thumb_entry));
+        }
+        struct thumb_entry *e = &idx->entries[idx->count++];
+        e->name  = strdup(f);
+        e->mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+        e->size  = st.st_size;
+        e->cell  = -1;
+        e->dirty = 1;
+
+        struct thumb_entry *prev = bsearch(e, old->entries, old->count,
+                sizeof(struct thumb_entry), compare_entries);
+        if (prev == NULL or used[prev->cell])
+            continue;
+        e->cell = prev->cell;
+        e->dirty = prev->mtime not_eq e->mtime or prev->size not_eq e->size;
+        used[e->cell] = 1;
+    }
+    closedir(d);
+
+    int next_free = 0;
+    for (int i = 0; i < idx->count; i++) {
+        struct thumb_entry *e = &idx->entries[i];
+        if (e->cell >= 0)
+            continue;
+        while (next_free < old->cells and used[next_free])
+            ++next_free;
+        if (next_free < old->cells)
+            used[next_free] = 1;
+        e->cell = next_free < old->cells ? next_free : idx->cells++;
+    }
+    free(used);
+    return EXIT_SUCCESS;
+}
+
+/************************** Pipeline Functions ************************/
+static void *decode_worker (void *arg)
+{
+    struct thumb_pipeline *p = arg;
+    struct thumb_job *job;
+
+    while ((job = queue_pop(&p->decode)) not_eq NULL) {
+        int w, h;
+        unsigned char *src;
+        const size_t len = ABG_THUMB_W * ABG_THUMB_H * 3;
+        job->pixels = malloc(len);
+        if (decode_image(job->path, &w, &h, &src)) {
+            memset(job->pixels, 0, len);
+            job->entry->mtime = -1;
+        } else {
+            scale_thumb(src, w, h, job->pixels);
+            free(src);
+        }
+        queue_push(&p->pack, job);
+    }
+    return NULL;
+}
+
+static void *pack_worker (void *arg)
+{
+    struct thumb_pipeline *p = arg;
+    struct thumb_job *job;
+
+    while ((job = queue_pop(&p->pack)) not_eq NULL) {
+        copy_cell(p->atlas, job->entry->cell, job->pixels);
+        free(job->pixels);
+        free(job->path);
+        free(job);
+    }
+    return NULL;
+}
+
+/*
+ * Returns the path of one of the atlas files for dir. Each directory gets
+ * its own pair, named after a hash of its path.
+ */
+static char *thumb_path (const char *cache, const char *format,
+        const char *dir)
+{
+    char name[64];
+    snprintf(name, sizeof(name), format,
+            hash_bytes(ABG_HASH_SEED, dir, strlen(dir)));
+    return join_path(cache, name);
+}
+
+/**
+ * Generates the thumbnail atlas and index for the given directory.
+ *
+ * Dirty files are fed through a decode -> downscale -> pack pipeline:
+ * one decoder thread per core pulls from a bounded queue, and a single
+ * packer writes finished cells into the mmap'd atlas.
+ *
+ * The atlas stays flock'd for the whole run so concurrent runs on the
+ * same directory take turns.
+ */
+int gen_thumbs (const char *dir)
+{
+    char *cache = get_cache_dir();
+    if (cache == NULL)
+        return EXIT_FAILURE;
+    char *atlas_path = thumb_path(cache, ABG_ATLAS_FILE, dir);
+    char *index_path = thumb_path(cache, ABG_INDEX_FILE, dir);
+    free(cache);
+
+    int fd = open(atlas_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 or flock(fd, LOCK_EX)) {
+        fprintf(stderr, "ERROR: Cannot lock %s\n", atlas_path);
+        if (fd >= 0)
+            close(fd);
+        free(atlas_path);
+        free(index_path);
+        return EXIT_FAILURE;
+    }
+
+    // An atlas that is missing or cut short invalidates the whole index
+    struct thumb_index old, idx;
+    struct stat st;
+    load_index(index_path, dir, &old);
+    if (fstat(fd, &st) or (size_t) st.st_size < atlas_size(old.cells))
+        free_thumb_index(&old);
+
+    if (scan_library(dir, &old, &idx)) {
+        free_thumb_index(&old);
+        close(fd);
+        free(atlas_path);
+        free(index_path);
+        return EXIT_FAILURE;
+    }
+
+    size_t len;
+    struct thumb_pipeline p;
+    unsigned char *map = map_atlas(fd, idx.cells, &len);
+    if (map == NULL) {
+        fprintf(stderr, "ERROR: Cannot map %s\n", atlas_path);
+        free_thumb_index(&old);
+        free_thumb_index(&idx);
+        close(fd);
+        free(atlas_path);
+        free(index_path);
+        return EXIT_FAILURE;
+    }
+    p.atlas = map + ABG_ATLAS_HEADER;
+    blank_stale_cells(p.atlas, &old, &idx);
+    free_thumb_index(&old);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int) cores : 1;
+    pthread_t *decoders = malloc(workers * sizeof(pthread_t));
+    pthread_t packer;
+
+    queue_init(&p.decode);
+    queue_init(&p.pack);
+    pthread_create(&packer, NULL, pack_worker, &p);
+    for (int i = 0; i < workers; i++)
+        pthread_create(&decoders[i], NULL, decode_worker, &p);
+
+    int dirty = 0;
+    for (int i = 0; i < idx.count; i++) {
+        struct thumb_entry *e = &idx.entries[i];
+        if (not e->dirty)
+            continue;
+        struct thumb_job *job = malloc(sizeof(struct thumb_job));
+        job->entry = e;
+        job->path  = join_path(dir, e->name);
+        queue_push(&p.decode, job);
+        ++dirty;
+    }
+
+    for (int i = 0; i < workers; i++)
+        queue_push(&p.decode, NULL);
+    for (int i = 0; i < workers; i++)
+        pthread_join(decoders[i], NULL);
+    queue_push(&p.pack, NULL);
+    pthread_join(packer, NULL);
+    queue_destroy(&p.decode);
+    queue_destroy(&p.pack);
+    free(decoders);
+
+    msync(map, len, MS_SYNC);
+    munmap(map, len);
+
+    int status = save_index(index_path, dir, &idx);
+    if (status)
+        fprintf(stderr, "ERROR: Cannot write %s\n", index_path);
+    else
+        printf("%s: %d thumbnails, %d regenerated\n", atlas_path, idx.count,
+                dirty);
+
+    close(fd);                          // Releases the lock
+    free_thumb_index(&idx);
+    free(atlas_path);
+    free(index_path);
+    return status;
+}
+
+// EOF
@@ -32,15 +32,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include <autobg.h>
-#include <stdarg.h>
-
-#define FAIL "[\e[01;31mFAIL\e[00m]"
-#define PASS "[\e[01;32mPASS\e[00m]"
-
-#define MIN(a, b) \
-    ({ __typeof__ (a) _a = (a); \
-       __typeof__ (b) _b = (b); \
-       _a > _b ? _b : _a; })
+#include <time.h>
+#include "test.h"
 
 /************************ Function Prototypes *************************/
 // Setup functions
@@ -48,45 +41,30 @@ static int test_count_bgs           ();
 static int test_get_next_bg         ();
 static int test_get_relpath         ();
 static int test_join_path           ();
+static int test_journal_recovery    ();
 static int test_populate_bgs        ();
-
-// Print functions
-void       print_test_result        (const char *, ...);
-void       print_test_status        (int, const char *);
+static int test_scale_thumb         ();
+static int test_scan_library        ();
+static int test_stream_next_bg      ();
 
 /******************************** Main ********************************/
 int main (int argc, const char **argv)
 {
-    printf("[\e[01;32mPASS\e[00m/\e[01;31mFAIL\e[00m]\tTest Name\t\t");
-    printf("Expected:\t\tGot:\n\n");
+    print_test_header();
 
     test_count_bgs();
     test_get_relpath();
     test_join_path();
     test_get_next_bg();
+    test_populate_bgs();
+    test_stream_next_bg();
+    test_journal_recovery();
+    test_scale_thumb();
+    test_scan_library();
 
     return EXIT_SUCCESS;
 }
 
-/******************************** Print ********************************/
-void print_test_result (const char *format, ...)
-{
-    va_list args;
-    va_start(args, format);
-    vprintf(format, args);
-}
-
-void print_test_status(int status, const char *test)
-{
-    if (status)
-        printf("%s\t\t", FAIL);
-    else
-        printf("%s\t\t", PASS);
-    printf("%s:\t", test);
-    if (strlen(test) < 16)
-        printf("\t");
-}
-
 /******************************** Tests ********************************/
 static int test_count_bgs ()
 {
@@ -150,8 +128,320 @@ static int test_join_path ()
     return status;
 }
 
+/*
+ * Repeatedly kills a process that is appending to the journal as fast as
+ * it can, sometimes tearing bytes off the end of the file as a crash
+ * mid-write would, and checks that recovery always yields a consistent
+ * state: every record names the wallpaper after its own sequence number.
+ * Then damages the snapshot, which must not cost the records after it.
+ */
+static int test_journal_recovery ()
+{
+    char dir[] = "/tmp/autobg-test-XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        return EXIT_FAILURE;
+    char *journal = join_path(dir, ABG_JOURNAL_FILE);
+    srand(time(NULL));
+
+    int status = 0, rounds = 0;
+    unsigned long long last = 0;
+    char expected[32] = "", got[PATH_MAX] = "";
+    for (; rounds < 50 and not status; rounds++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            struct abg_journal j;
+            char bg[32];
+            if (journal_open(&j, dir))
+                _exit(EXIT_FAILURE);
+            for (;;) {
+                snprintf(bg, sizeof(bg), "/bg/%llu", j.state.seq + 1);
+                journal_append(&j, ABG_EV_NEXT, bg, -1);
+            }
+        }
+        struct timespec nap = { 0, (rand() % 20000) * 1000 };
+        nanosleep(&nap, NULL);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+
+        struct stat st;
+        int torn = rand() % 2 and not stat(journal, &st) and st.st_size > 0;
+        if (torn)
+            truncate(journal, st.st_size - 1 - rand() % MIN(st.st_size, 64));
+
+        struct abg_journal j;
+        if (journal_open(&j, dir)) {
+            status = 1;
+            break;
+        }
+        snprintf(expected, sizeof(expected), "/bg/%llu", j.state.seq);
+        strcpy(got, j.state.current);
+        if (j.state.seq and strcmp(expected, got))
+            status = 1;
+        if (not torn and j.state.seq < last)
+            status = 1;
+        last = j.state.seq;
+        journal_close(&j);
+    }
+
+    // Compact once, leaving records past the snapshot, then flip a byte
+    // of the snapshot's path so its CRC fails
+    char *snapshot = join_path(dir, ABG_SNAPSHOT_FILE);
+    struct abg_journal j;
+    if (not status and not journal_open(&j, dir)) {
+        unsigned long long target = j.state.seq + ABG_JOURNAL_MAX + 44;
+        char bg[32];
+        while (j.state.seq < target) {
+            snprintf(bg, sizeof(bg), "/bg/%llu", j.state.seq + 1);
+            journal_append(&j, ABG_EV_NEXT, bg, -1);
+        }
+        journal_close(&j);
+
+        struct stat st;
+        int fd = open(snapshot, O_RDWR);
+        char c;
+        status = fd < 0 or fstat(fd, &st)
+            or pread(fd, &c, 1, st.st_size - 1) not_eq 1;
+        c ^= 0x20;
+        status = status or pwrite(fd, &c, 1, st.st_size - 1) not_eq 1;
+        if (fd >= 0)
+            close(fd);
+
+        snprintf(expected, sizeof(expected), "/bg/%llu", target);
+        got[0] = 0;
+        if (status or journal_open(&j, dir)) {
+            status = 1;
+        } else {
+            strcpy(got, j.state.current);
+            status = j.state.seq not_eq target or strcmp(expected, got);
+            journal_close(&j);
+        }
+    }
+
+    print_test_status(status, "test_journal_recovery");
+    print_test_result("%s\t\t%s\n", expected, got);
+
+    unlink(journal);
+    unlink(snapshot);
+    rmdir(dir);
+    free(journal);
+    free(snapshot);
+    return status;
+}
+
 static int test_populate_bgs ()
 {
+    char dir[] = "/tmp/autobg-test-XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        return EXIT_FAILURE;
+    char *bg = join_path(dir, "Picture00.jpg");
+    close(open(bg, O_WRONLY | O_CREAT, 0644));
+
+    char **bg_list = calloc(2, sizeof(char*));
+    int status = populate_bgs(dir, bg_list) or bg_list[0] == NULL
+        or strcmp(bg, bg_list[0]);
+
+    print_test_status(status, "test_populate_bgs");
+    print_test_result("%s\t%s\n", bg, bg_list[0] ? bg_list[0] : "(null)");
+
+    unlink(bg);
+    rmdir(dir);
+    free(bg);
+    free_bg_strs(bg_list);
+    return status;
+}
+
+/*
+ * Walks a directory with stream_next_bg() and checks every wallpaper is
+ * visited once per lap, in readdir() order, whether or not the hint from
+ * the previous switch is usable, and that a usable hint spares the scan.
+ */
+static int test_stream_next_bg ()
+{
+    char dir[] = "/tmp/autobg-test-XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        return EXIT_FAILURE;
+    char name[32];
+    for (int n = 0; n < 32; n++) {
+        snprintf(name, sizeof(name), "Picture%02d.jpg", n);
+        char *bg = join_path(dir, name);
+        close(open(bg, O_WRONLY | O_CREAT, 0644));
+        free(bg);
+    }
+
+    int count = 0;
+    count_bgs(dir, &count);
+    char **bg_list = calloc(count + 1, sizeof(char*));
+    populate_bgs(dir, bg_list);
+
+    int status = 0;
+    long hint = -1;
+    unsigned long reads, most = 0;
+    char *current = strdup("");
+    char *expected = bg_list[0];
+    for (int n = 0; n < 2 * count and not status; n++) {
+        if (n == count)
+            hint = 12345;               // A stale hint must not matter
+        reads = bg_reads;
+        char *next = stream_next_bg(dir, current, &hint);
+        reads = bg_reads - reads;
+        expected = n ? get_next_bg(bg_list, current) : bg_list[0];
+        status = next == NULL or strcmp(expected, next);
+        free(current);
+        current = next ? next : strdup("");
+        // With a good hint, only the entries up to the successor are
+        // read (at most "." and ".." between them), not a scan. The
+        // switch that wraps around rereads from the start, so skip it.
+        if (n > 0 and n < count and expected not_eq bg_list[0]
+                and reads > most)
+            most = reads;
+    }
+    status = status or most > 4;
+
+    print_test_status(status, "test_stream_next_bg");
+    print_test_result("%s\t%s\n", expected, current);
+
+    for (int n = 0; bg_list[n] not_eq NULL; n++)
+        unlink(bg_list[n]);
+    rmdir(dir);
+    free(current);
+    free_bg_strs(bg_list);
+    return status;
+}
+
+/*
+ * A 2x image fills the cell exactly; a small one is centered unscaled.
+ */
+static int test_scale_thumb ()
+{
+    const int big_w = ABG_THUMB_W * 2, big_h = ABG_THUMB_H * 2;
+    unsigned char *big  = malloc(big_w * big_h * 3);
+    unsigned char *cell = malloc(ABG_THUMB_W * ABG_THUMB_H * 3);
+    unsigned char small[40 * 20 * 3];
+    for (int n = 0; n < big_w * big_h * 3; n++)
+        big[n] = n % 3 ? 20 : 200;
+    for (int n = 0; n < 40 * 20 * 3; n++)
+        small[n] = 90;
+
+    int status = 0;
+    scale_thumb(big, big_w, big_h, cell);
+    for (int n = 0; n < ABG_THUMB_W * ABG_THUMB_H * 3 and not status; n++)
+        status = cell[n] not_eq (n % 3 ? 20 : 200);
+
+    scale_thumb(small, 40, 20, cell);
+    int ox = (ABG_THUMB_W - 40) / 2, oy = (ABG_THUMB_H - 20) / 2;
+    int inside  = cell[(oy * ABG_THUMB_W + ox) * 3];
+    int outside = cell[((oy - 1) * ABG_THUMB_W + ox) * 3];
+    status = status or inside not_eq 90 or outside not_eq 0;
+
+    print_test_status(status, "test_scale_thumb");
+    print_test_result("90 0\t\t\t%d %d\n", inside, outside);
+    free(big);
+    free(cell);
+    return status;
+}
+
+static int compare_thumb_names (const void *a, const void *b)
+{
+    return strcmp(((const struct thumb_entry *) a)->name,
+            ((const struct thumb_entry *) b)->name);
+}
 
+static struct thumb_entry *find_thumb (struct thumb_index *idx,
+        const char *name)
+{
+    for (int n = 0; n < idx->count; n++)
+        if (not strcmp(idx->entries[n].name, name))
+            return &idx->entries[n];
+    return NULL;
 }
 
+static void touch_bg (const char *dir, const char *name)
+{
+    char *bg = join_path(dir, name);
+    close(open(bg, O_WRONLY | O_CREAT, 0644));
+    free(bg);
+}
+
+static void remove_bg (const char *dir, const char *name)
+{
+    char *bg = join_path(dir, name);
+    unlink(bg);
+    free(bg);
+}
+
+/*
+ * Scans a directory, then deletes two files and adds one: untouched files
+ * keep their cells and stay clean, the new file takes a freed cell, and
+ * the other freed cell is blanked without growing the atlas. Finally a
+ * file rewritten within the same second, at the same size, must be dirty.
+ */
+static int test_scan_library ()
+{
+    char dir[] = "/tmp/autobg-test-XXXXXX";
+    if (mkdtemp(dir) == NULL)
+        return EXIT_FAILURE;
+    touch_bg(dir, "a.jpg");
+    touch_bg(dir, "b.jpg");
+    touch_bg(dir, "c.jpg");
+
+    struct thumb_index none = { 0, 0, NULL }, old = none, idx = none;
+    int status = scan_library(dir, &none, &old) or old.count not_eq 3
+        or old.cells not_eq 3;
+    for (int n = 0; n < old.count; n++) {
+        status = status or not old.entries[n].dirty;
+        old.entries[n].dirty = 0;
+    }
+    qsort(old.entries, old.count, sizeof(struct thumb_entry),
+            compare_thumb_names);
+
+    remove_bg(dir, "b.jpg");
+    remove_bg(dir, "c.jpg");
+    touch_bg(dir, "d.jpg");
+    status = status or scan_library(dir, &old, &idx);
+
+    struct thumb_entry *a = find_thumb(&idx, "a.jpg");
+    struct thumb_entry *d = find_thumb(&idx, "d.jpg");
+    struct thumb_entry *b = find_thumb(&old, "b.jpg");
+    struct thumb_entry *c = find_thumb(&old, "c.jpg");
+    status = status or idx.count not_eq 2 or idx.cells not_eq 3 or a == NULL
+        or d == NULL or a->dirty or not d->dirty
+        or a->cell not_eq find_thumb(&old, "a.jpg")->cell
+        or (d->cell not_eq b->cell and d->cell not_eq c->cell);
+
+    size_t stride = (size_t) ABG_THUMB_COLS * ABG_THUMB_W * 3;
+    unsigned char *atlas = malloc(stride * ABG_THUMB_H);
+    memset(atlas, 0xff, stride * ABG_THUMB_H);
+    if (not status) {
+        int freed = d->cell == b->cell ? c->cell : b->cell;
+        blank_stale_cells(atlas, &old, &idx);
+        status = atlas[freed * ABG_THUMB_W * 3] not_eq 0
+            or atlas[a->cell * ABG_THUMB_W * 3] not_eq 0xff
+            or atlas[d->cell * ABG_THUMB_W * 3] not_eq 0xff;
+    }
+
+    struct thumb_index again = none;
+    char *bg = join_path(dir, "a.jpg");
+    struct stat st;
+    if (not status and not stat(bg, &st)) {
+        struct timespec times[2] = { st.st_mtim, st.st_mtim };
+        times[1].tv_nsec = (times[1].tv_nsec + 1) % 1000000000L;
+        qsort(idx.entries, idx.count, sizeof(struct thumb_entry),
+                compare_thumb_names);
+        status = utimensat(AT_FDCWD, bg, times, 0)
+            or scan_library(dir, &idx, &again)
+            or not find_thumb(&again, "a.jpg")->dirty;
+    }
+    free(bg);
+
+    print_test_status(status, "test_scan_library");
+    print_test_result("%d\t\t\t%d\n", 2, idx.count);
+
+    remove_bg(dir, "a.jpg");
+    remove_bg(dir, "d.jpg");
+    rmdir(dir);
+    free(atlas);
+    free_thumb_index(&old);
+    free_thumb_index(&idx);
+    free_thumb_index(&again);
+    return status;
+}
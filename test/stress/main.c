@@ -0,0 +1,362 @@
+/*
+Copyright (c) 2013 Ryan Porterfield
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+    * Redistributions of source code must retain the above copyright notice,
+this list of conditions and the following disclaimer.
+
+   	* Redistributions in binary form must reproduce the above
+copyright notice, this list of conditions and the following disclaimer
+in the documentation and/or other materials provided with the
+distribution.
+
+	* Neither the name of the copyright owners nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <autobg.h>
+#include <ftw.h>
+#include <time.h>
+#include "../test.h"
+
+#define STRESS_FILES        2000    // Wallpapers present when the run starts
+#define STRESS_SUBDIRS      16      // Subdirectories the mutator keeps around
+#define STRESS_SWITCHES     50000   // Rotations to time
+#define STRESS_WARMUP       1000    // Rotations before the baseline RSS
+#define STRESS_OPS_PER_SEC  5000    // Creates, deletes and renames
+#define STRESS_RESTART      500     // Rotations between daemon restarts
+#define STRESS_P99_US       20000   // p99 switch latency threshold
+#define STRESS_RSS_KB       2048    // Allowed RSS growth after warmup
+
+/*
+ * Shared between the daemon loop and the mutator. The mutator only ever
+ * creates files named bg-<id>.jpg with id below next_id, so any other
+ * name, including one of its subdirectories, reaching the backend is a
+ * bug.
+ */
+struct stress {
+    char            *dir;
+    volatile int    stop;
+    int             next_id;
+    long            ops;
+    long            calls;
+    long            invalid;
+    long            missing;
+    char            last_invalid[PATH_MAX];
+
+    // Only touched from process(), through the stub backend and sleep
+    int             first;          // No wakeup yet since process() began
+    int             paused;
+    long            switches;
+    long            failures;
+    long            pauses;
+    long            woken_calls;    // Backend calls at the last wakeup
+    long            rss_start;
+    long            *latency;
+    struct timespec woken;
+};
+
+static struct stress st;
+
+/************************ Function Prototypes *************************/
+static void *   mutate              (void *);
+static long     rss_kb              ();
+static int      stub_backend        (const char *);
+static unsigned stub_sleep          (unsigned);
+
+static int      compare_longs       (const void *, const void *);
+static long     elapsed_us          (const struct timespec *,
+                                     const struct timespec *);
+static char *   make_tree           ();
+static int      remove_entry        (const char *, const struct stat *, int,
+                                     struct FTW *);
+
+/******************************** Main ********************************/
+int main (int argc, const char **argv)
+{
+    char *root = make_tree();
+    if (root == NULL) {
+        fprintf(stderr, "ERROR: Cannot create stress directory\n");
+        return EXIT_FAILURE;
+    }
+    bg_backend = stub_backend;
+    bg_sleep   = stub_sleep;
+    st.latency = malloc(STRESS_SWITCHES * sizeof(long));
+
+    pthread_t mutator;
+    pthread_create(&mutator, NULL, mutate, NULL);
+
+    // Each pass is one daemon lifetime; stub_sleep stops it every
+    // STRESS_RESTART switches so the journal is reopened and replayed
+    long restarts = 0;
+    while (st.switches < STRESS_WARMUP + STRESS_SWITCHES) {
+        st.first = 1;
+        process(st.dir, 1);
+        if (st.first) {
+            fprintf(stderr, "ERROR: Daemon loop exited before running\n");
+            ++st.failures;
+            break;
+        }
+        ++restarts;
+    }
+    long rss_growth = rss_kb() - st.rss_start;
+
+    st.stop = 1;
+    pthread_join(mutator, NULL);
+
+    long timed = MIN(st.switches - STRESS_WARMUP, STRESS_SWITCHES);
+    long p50 = 0, p99 = 0;
+    if (timed > 0) {
+        qsort(st.latency, timed, sizeof(long), compare_longs);
+        p50 = st.latency[timed / 2];
+        p99 = st.latency[timed * 99 / 100];
+    }
+
+    print_test_header();
+
+    int status = 0;
+    print_test_status(st.invalid not_eq 0, "invalid_paths");
+    print_test_result("0\t\t\t%ld %s\n", st.invalid, st.last_invalid);
+    status |= st.invalid not_eq 0;
+
+    print_test_status(st.failures not_eq 0, "failed_switches");
+    print_test_result("0\t\t\t%ld\n", st.failures);
+    status |= st.failures not_eq 0;
+
+    print_test_status(rss_growth > STRESS_RSS_KB, "rss_growth_kb");
+    print_test_result("<= %d\t\t\t%ld\n", STRESS_RSS_KB, rss_growth);
+    status |= rss_growth > STRESS_RSS_KB;
+
+    print_test_status(p99 > STRESS_P99_US, "p99_switch_us");
+    print_test_result("<= %d\t\t%ld (p50 %ld)\n", STRESS_P99_US, p99, p50);
+    status |= p99 > STRESS_P99_US;
+
+    printf("\n%ld backend calls, %ld already deleted when set, "
+            "%ld filesystem operations\n", st.calls, st.missing, st.ops);
+    printf("%ld daemon restarts, %ld pauses\n", restarts, st.pauses);
+
+    nftw(root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    free(st.latency);
+    free(st.dir);
+    free(root);
+    return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/******************************* Stress *******************************/
+/*
+ * Creates, deletes and renames wallpapers at STRESS_OPS_PER_SEC until
+ * told to stop, and keeps making and removing subdirectories alongside
+ * them. Only this thread touches the live lists.
+ */
+static void *mutate (void *arg)
+{
+    int *live = malloc(STRESS_FILES * 2 * sizeof(int));
+    int count = 0;
+    for (int id = 0; id < STRESS_FILES; id++)
+        live[count++] = id;
+    int subdirs[STRESS_SUBDIRS], nsubdirs = 0, next_subdir = 0;
+
+    char from[PATH_MAX], to[PATH_MAX];
+    struct timespec nap = { 0, 10000000 };
+    unsigned seed = 1;
+    while (not st.stop) {
+        for (int k = 0; k < STRESS_OPS_PER_SEC / 100; k++) {
+            int op = rand_r(&seed) % 4, victim = rand_r(&seed) % count;
+            int id = __atomic_load_n(&st.next_id, __ATOMIC_RELAXED);
+            snprintf(from, sizeof(from), "%s/bg-%06d.jpg", st.dir,
+                    live[victim]);
+            snprintf(to, sizeof(to), "%s/bg-%06d.jpg", st.dir, id);
+
+            if (op == 3) {
+                if (nsubdirs < STRESS_SUBDIRS) {
+                    subdirs[nsubdirs++] = next_subdir;
+                    snprintf(to, sizeof(to), "%s/sub-%06d", st.dir,
+                            next_subdir++);
+                    mkdir(to, 0755);
+                } else {
+                    victim = rand_r(&seed) % nsubdirs;
+                    snprintf(from, sizeof(from), "%s/sub-%06d", st.dir,
+                            subdirs[victim]);
+                    rmdir(from);
+                    subdirs[victim] = subdirs[--nsubdirs];
+                }
+                ++st.ops;
+                continue;
+            }
+
+            if (count < STRESS_FILES / 2)
+                op = 0;
+            else if (count == STRESS_FILES * 2)
+                op = 1;
+
+            // Publish the id before its file can be seen
+            if (op not_eq 1)
+                __atomic_store_n(&st.next_id, id + 1, __ATOMIC_RELEASE);
+            if (op == 0) {
+                close(open(to, O_WRONLY | O_CREAT, 0644));
+                live[count++] = id;
+            } else if (op == 1) {
+                unlink(from);
+                live[victim] = live[--count];
+            } else {
+                rename(from, to);
+                live[victim] = id;
+            }
+            ++st.ops;
+        }
+        nanosleep(&nap, NULL);
+    }
+    free(live);
+    return NULL;
+}
+
+static long rss_kb ()
+{
+    FILE *statm = fopen("/proc/self/statm", "r");
+    long pages = 0;
+    if (statm == NULL)
+        return 0;
+    if (fscanf(statm, "%*d %ld", &pages) not_eq 1)
+        pages = 0;
+    fclose(statm);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Stands in for feh. A path is valid if it names a wallpaper file the
+ * mutator created at some point; it may already be gone by the time it's
+ * set, but it must never be a directory.
+ */
+static int stub_backend (const char *path)
+{
+    size_t dir_len = strlen(st.dir);
+    int id = -1, n = 0;
+    int valid = not strncmp(path, st.dir, dir_len) and path[dir_len] == '/'
+        and sscanf(path + dir_len + 1, "bg-%6d.jpg%n", &id, &n) == 1
+        and path[dir_len + 1 + n] == 0 and id >= 0
+        and id < __atomic_load_n(&st.next_id, __ATOMIC_ACQUIRE);
+
+    struct stat sb;
+    int exists = not stat(path, &sb);
+    valid = valid and not (exists and S_ISDIR(sb.st_mode));
+
+    ++st.calls;
+    if (not valid) {
+        ++st.invalid;
+        snprintf(st.last_invalid, sizeof(st.last_invalid), "%s", path);
+    } else if (not exists) {
+        ++st.missing;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Stands in for sleep() in the daemon loop, so process() switches flat
+ * out. Every wakeup closes one loop iteration, which must have switched
+ * unless the daemon was paused; it is timed, and every so often the
+ * daemon is paused and resumed with SIGUSR1 or restarted with SIGTERM.
+ */
+static unsigned stub_sleep (unsigned seconds)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int switched = 0;
+    if (not st.first) {
+        switched = st.calls not_eq st.woken_calls;
+        st.failures += switched == st.paused;
+        if (switched) {
+            long n = st.switches++ - STRESS_WARMUP;
+            if (n >= 0 and n < STRESS_SWITCHES)
+                st.latency[n] = elapsed_us(&st.woken, &now);
+        }
+    }
+    st.first = 0;
+    if (switched and st.switches == STRESS_WARMUP)
+        st.rss_start = rss_kb();
+
+    if (st.paused) {
+        raise(SIGUSR1);
+        st.paused = 0;
+    } else if (switched and st.switches % STRESS_RESTART
+            == STRESS_RESTART / 2) {
+        raise(SIGUSR1);
+        st.paused = 1;
+        ++st.pauses;
+    } else if (switched and (st.switches % STRESS_RESTART == 0
+                or st.switches >= STRESS_WARMUP + STRESS_SWITCHES)) {
+        raise(SIGTERM);
+    }
+
+    st.woken_calls = st.calls;
+    clock_gettime(CLOCK_MONOTONIC, &st.woken);
+    return 0;
+}
+
+/******************************* Helpers ******************************/
+static int compare_longs (const void *a, const void *b)
+{
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+static long elapsed_us (const struct timespec *a, const struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1000000L
+        + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/*
+ * Builds the wallpaper directory, on tmpfs when /dev/shm is available,
+ * and points $HOME there so the journal lands beside it and no real
+ * ~/.fehbg is read.
+ */
+static char *make_tree ()
+{
+    char tmpl[] = "/dev/shm/autobg-stress-XXXXXX";
+    char *root = mkdtemp(tmpl);
+    if (root == NULL) {
+        strcpy(tmpl, "/tmp/autobg-stress-XXXXXX");
+        root = mkdtemp(tmpl);
+    }
+    if (root == NULL)
+        return NULL;
+    root = strdup(root);
+    setenv("HOME", root, 1);
+
+    st.dir = join_path(root, "wallpapers");
+    if (mkdir(st.dir, 0755))
+        return NULL;
+
+    char bg[PATH_MAX];
+    for (int id = 0; id < STRESS_FILES; id++) {
+        snprintf(bg, sizeof(bg), "%s/bg-%06d.jpg", st.dir, id);
+        close(open(bg, O_WRONLY | O_CREAT, 0644));
+    }
+    st.next_id = STRESS_FILES;
+    return root;
+}
+
+static int remove_entry (const char *path, const struct stat *sb, int flag,
+        struct FTW *ftw)
+{
+    remove(path);
+    return 0;
+}